@@ -0,0 +1,210 @@
+#include "ConvolutionEngine.h"
+
+PartitionedConvolution::PartitionedConvolution(const std::vector<float> &impulseResponse, int newPartitionSize, int numChannels, int newTapsVersion)
+    : partitionSize(newPartitionSize),
+      fftSize(2 * newPartitionSize),
+      numBins(newPartitionSize + 1),
+      numPartitions(juce::jmax(1, (static_cast<int>(impulseResponse.size()) + newPartitionSize - 1) / newPartitionSize)),
+      tapsVersion(newTapsVersion),
+      fft(juce::roundToInt(std::log2(2 * newPartitionSize))),
+      fftBuffer(static_cast<size_t>(2 * fftSize), 0.0f),
+      partitions(static_cast<size_t>(numPartitions * numBins)),
+      channels(static_cast<size_t>(numChannels))
+{
+    jassert(juce::isPowerOfTwo(partitionSize));
+    jassert(numChannels >= 0);
+    // Each partition is zero padded to twice its size so the products don't wrap around
+    for (int partition = 0; partition < numPartitions; ++partition)
+    {
+        std::fill(fftBuffer.begin(), fftBuffer.end(), 0.0f);
+        const auto start = static_cast<size_t>(partition * partitionSize);
+        const auto end = juce::jmin(impulseResponse.size(), start + static_cast<size_t>(partitionSize));
+        std::copy(impulseResponse.begin() + static_cast<std::ptrdiff_t>(start), impulseResponse.begin() + static_cast<std::ptrdiff_t>(end), fftBuffer.begin());
+        fft.performRealOnlyForwardTransform(fftBuffer.data(), true);
+        auto *spectrum = partitions.data() + static_cast<size_t>(partition * numBins);
+        for (int bin = 0; bin < numBins; ++bin)
+        {
+            spectrum[bin] = {fftBuffer[static_cast<size_t>(2 * bin)], fftBuffer[static_cast<size_t>(2 * bin + 1)]};
+        }
+    }
+    for (auto &state : channels)
+    {
+        state.inputBlock.assign(static_cast<size_t>(partitionSize), 0.0f);
+        state.overlap.assign(static_cast<size_t>(partitionSize), 0.0f);
+        state.inputSpectra.assign(static_cast<size_t>(numPartitions * numBins), {});
+        state.tailSpectrum.assign(static_cast<size_t>(numBins), {});
+    }
+}
+
+void PartitionedConvolution::process(const float *input, float *output, int numSamples, int channel)
+{
+    jassert(channel >= 0 && channel < getNumChannels());
+    auto &state = channels[static_cast<size_t>(channel)];
+    int numProcessed = 0;
+    while (numProcessed < numSamples)
+    {
+        const int numToProcess = juce::jmin(numSamples - numProcessed, partitionSize - state.inputPosition);
+        if (state.inputPosition == 0)
+        {
+            // The older blocks' share of this block doesn't change while it fills up,
+            // so it's only worked out once per block
+            std::fill(state.tailSpectrum.begin(), state.tailSpectrum.end(), Complex{});
+            for (int partition = 1; partition < numPartitions; ++partition)
+            {
+                const auto *inputSpectrum = getInputSpectrum(state, (state.currentPartition + partition) % numPartitions);
+                const auto *impulseSpectrum = getPartition(partition);
+                for (int bin = 0; bin < numBins; ++bin)
+                {
+                    state.tailSpectrum[static_cast<size_t>(bin)] += inputSpectrum[bin] * impulseSpectrum[bin];
+                }
+            }
+        }
+        auto *inputBlock = state.inputBlock.data();
+        if (input != nullptr)
+            std::copy(input + numProcessed, input + numProcessed + numToProcess, inputBlock + state.inputPosition);
+        else
+            std::fill(inputBlock + state.inputPosition, inputBlock + state.inputPosition + numToProcess, 0.0f);
+
+        // Spectrum of the block so far, the samples still to come are zero
+        std::fill(fftBuffer.begin(), fftBuffer.end(), 0.0f);
+        std::copy(state.inputBlock.begin(), state.inputBlock.end(), fftBuffer.begin());
+        fft.performRealOnlyForwardTransform(fftBuffer.data(), true);
+        auto *currentSpectrum = getInputSpectrum(state, state.currentPartition);
+        const auto *firstPartition = getPartition(0);
+        for (int bin = 0; bin < numBins; ++bin)
+        {
+            currentSpectrum[bin] = {fftBuffer[static_cast<size_t>(2 * bin)], fftBuffer[static_cast<size_t>(2 * bin + 1)]};
+            const auto outputBin = state.tailSpectrum[static_cast<size_t>(bin)] + currentSpectrum[bin] * firstPartition[bin];
+            fftBuffer[static_cast<size_t>(2 * bin)] = outputBin.real();
+            fftBuffer[static_cast<size_t>(2 * bin + 1)] = outputBin.imag();
+        }
+        // The output is real, so the negative frequencies mirror the positive ones
+        for (int bin = numBins; bin < fftSize; ++bin)
+        {
+            fftBuffer[static_cast<size_t>(2 * bin)] = fftBuffer[static_cast<size_t>(2 * (fftSize - bin))];
+            fftBuffer[static_cast<size_t>(2 * bin + 1)] = -fftBuffer[static_cast<size_t>(2 * (fftSize - bin) + 1)];
+        }
+        fft.performRealOnlyInverseTransform(fftBuffer.data());
+
+        for (int sample = 0; sample < numToProcess; ++sample)
+        {
+            const auto position = static_cast<size_t>(state.inputPosition + sample);
+            output[numProcessed + sample] += fftBuffer[position] + state.overlap[position];
+        }
+        state.inputPosition += numToProcess;
+        if (state.inputPosition == partitionSize)
+        {
+            // The block is full, its second half carries over into the next one
+            std::copy(fftBuffer.begin() + partitionSize, fftBuffer.begin() + fftSize, state.overlap.begin());
+            std::fill(state.inputBlock.begin(), state.inputBlock.end(), 0.0f);
+            state.inputPosition = 0;
+            state.currentPartition = (state.currentPartition + numPartitions - 1) % numPartitions;
+        }
+        numProcessed += numToProcess;
+    }
+}
+
+//==============================================================================
+ConvolutionEngine::ConvolutionEngine() : juce::ThreadPoolJob("Convolution build") {}
+
+ConvolutionEngine::~ConvolutionEngine()
+{
+    // A build that is already running is left to finish, it can't be stopped half way
+    if (buildThread != nullptr)
+        (*buildThread)->removeJob(this, false, -1);
+    delete pending.exchange(nullptr);
+    delete retired.exchange(nullptr);
+    delete current;
+}
+
+std::vector<float> ConvolutionEngine::makeTapImpulseResponse(const double *tapOffsets, int delayReps, const float *repGains)
+{
+    jassert(delayReps >= 0);
+    double length = 0.0;
+    for (int rep = 0; rep < delayReps; ++rep)
+    {
+        jassert(tapOffsets[rep] >= 0.0);
+        length = juce::jmax(length, tapOffsets[rep]);
+    }
+    std::vector<float> impulseResponse(static_cast<size_t>(std::ceil(length)) + 2, 0.0f);
+    for (int rep = 0; rep < delayReps; ++rep)
+    {
+        // Split taps that fall between two samples the same way the direct engine interpolates
+        const double position = tapOffsets[rep];
+        const auto positionFloor = static_cast<size_t>(position);
+        const auto fraction = static_cast<float>(position - static_cast<double>(positionFloor));
+        impulseResponse[positionFloor] += repGains[rep] * (1.0f - fraction);
+        impulseResponse[positionFloor + 1] += repGains[rep] * fraction;
+    }
+    return impulseResponse;
+}
+
+void ConvolutionEngine::build(TapSettings settings)
+{
+    if (buildThread == nullptr)
+        buildThread = std::make_unique<juce::SharedResourcePointer<BuildThread>>();
+    bool needsStarting = false;
+    {
+        const juce::ScopedLock lock(buildLock);
+        nextBuild = std::move(settings);
+        hasNextBuild = true;
+        needsStarting = !isBuilding;
+        isBuilding = true;
+    }
+    if (needsStarting)
+    {
+        // The job may still be on its way out of the pool after its last build
+        (*buildThread)->waitForJobToFinish(this, -1);
+        (*buildThread)->addJob(this, false);
+    }
+}
+
+void ConvolutionEngine::waitForBuild()
+{
+    if (buildThread != nullptr)
+        (*buildThread)->waitForJobToFinish(this, -1);
+}
+
+juce::ThreadPoolJob::JobStatus ConvolutionEngine::runJob()
+{
+    for (;;)
+    {
+        TapSettings settings;
+        {
+            const juce::ScopedLock lock(buildLock);
+            if (!hasNextBuild)
+            {
+                isBuilding = false;
+                return jobHasFinished;
+            }
+            settings = std::move(nextBuild);
+            hasNextBuild = false;
+        }
+        jassert(settings.tapOffsets.size() == settings.repGains.size());
+        const auto impulseResponse = makeTapImpulseResponse(settings.tapOffsets.data(), static_cast<int>(settings.tapOffsets.size()), settings.repGains.data());
+        setPending(std::make_unique<PartitionedConvolution>(impulseResponse, settings.partitionSize, settings.numChannels, settings.tapsVersion));
+    }
+}
+
+void ConvolutionEngine::setPending(std::unique_ptr<PartitionedConvolution> convolution)
+{
+    // If the audio thread never picked up the previous one, it's ours to free
+    delete pending.exchange(convolution.release());
+}
+
+void ConvolutionEngine::releaseRetired()
+{
+    delete retired.exchange(nullptr);
+}
+
+void ConvolutionEngine::swapInPending()
+{
+    // Wait for the message thread to free the last one before retiring another
+    if (retired.load() != nullptr)
+        return;
+    if (auto *next = pending.exchange(nullptr))
+    {
+        retired.store(current);
+        current = next;
+    }
+}
@@ -0,0 +1,123 @@
+// A convolution engine for when the delay taps are static.
+// With a fixed delay time and fixed rep gains the whole effect is a sparse FIR
+// with one tap per rep. PartitionedConvolution runs an impulse response through
+// uniformly partitioned FFT convolution (overlap-add, no added latency).
+// ConvolutionEngine builds a PartitionedConvolution on a background thread shared by every
+// instance and hands it over to the audio thread without locking or allocating there.
+// The convolution cost grows with the length of the impulse response rather than the number
+// of taps, and this plugin has at most 5 taps spread over up to 10 seconds. At that tap count
+// the direct engine is cheaper in CPU and memory at every delay time; the convolution only
+// gets ahead with hundreds of taps. See the benchmarks in Tests/Benchmarks.cpp.
+
+#pragma once
+#include <atomic>
+#include <complex>
+#include <memory>
+#include <vector>
+#include <juce_dsp/juce_dsp.h>
+
+class PartitionedConvolution
+{
+public:
+    // Allocates everything needed to run impulseResponse on numChannels channels.
+    // tapsVersion identifies the delay settings the impulse response was built from.
+    PartitionedConvolution(const std::vector<float> &impulseResponse, int partitionSize, int numChannels, int tapsVersion);
+
+    // Adds the convolution of input with the impulse response to output.
+    // input may be nullptr to let the tail of earlier input ring out.
+    void process(const float *input, float *output, int numSamples, int channel);
+    // How long the output can keep going once the input stops
+    int getTailLength() const { return (numPartitions + 2) * partitionSize; }
+    int getNumChannels() const { return static_cast<int>(channels.size()); }
+    int getTapsVersion() const { return tapsVersion; }
+
+private:
+    using Complex = std::complex<float>;
+
+    struct ChannelState
+    {
+        // The block of input that is currently filling up
+        std::vector<float> inputBlock;
+        // The second half of the last full block's output
+        std::vector<float> overlap;
+        // The spectra of the last numPartitions input blocks, newest at currentPartition
+        std::vector<Complex> inputSpectra;
+        // What the older input blocks add to the block that is currently filling up
+        std::vector<Complex> tailSpectrum;
+        int inputPosition = 0;
+        int currentPartition = 0;
+    };
+
+    Complex *getInputSpectrum(ChannelState &state, int partition) { return state.inputSpectra.data() + static_cast<size_t>(partition * numBins); }
+    const Complex *getPartition(int partition) const { return partitions.data() + static_cast<size_t>(partition * numBins); }
+
+    int partitionSize;
+    int fftSize;
+    int numBins;
+    int numPartitions;
+    int tapsVersion;
+    juce::dsp::FFT fft;
+    // Scratch space for the FFT, interleaved complex
+    std::vector<float> fftBuffer;
+    // The spectra of the impulse response partitions
+    std::vector<Complex> partitions;
+    std::vector<ChannelState> channels;
+};
+
+class ConvolutionEngine : private juce::ThreadPoolJob
+{
+public:
+    ConvolutionEngine();
+    ~ConvolutionEngine() override;
+
+    // Everything a convolution is built from
+    struct TapSettings
+    {
+        // Where each tap lands in samples, and its gain
+        std::vector<double> tapOffsets;
+        std::vector<float> repGains;
+        int partitionSize = 512;
+        int numChannels = 0;
+        int tapsVersion = 0;
+    };
+
+    // Builds the impulse response of delayReps taps, at tapOffsets samples, weighted by repGains
+    static std::vector<float> makeTapImpulseResponse(const double *tapOffsets, int delayReps, const float *repGains);
+
+    // Message thread: build a convolution for settings on the background thread, it becomes
+    // pending once it's ready. A build that hasn't started yet is replaced by this one.
+    void build(TapSettings settings);
+    // Message thread: block until the last build asked for has become pending
+    void waitForBuild();
+    // Hand over a new convolution, replacing one that hasn't been picked up yet
+    void setPending(std::unique_ptr<PartitionedConvolution> convolution);
+    // Message thread: free the convolution the audio thread swapped out
+    void releaseRetired();
+    // Audio thread: swap in the pending convolution. Only call this while the
+    // current convolution has nothing left ringing out.
+    void swapInPending();
+    // Audio thread
+    PartitionedConvolution *getCurrent() const { return current; }
+
+private:
+    // The one background thread every instance builds on
+    struct BuildThread : juce::ThreadPool
+    {
+        BuildThread() : juce::ThreadPool(1) {}
+    };
+
+    JobStatus runJob() override;
+
+    // Only made once something is built, so instances that never use the engine don't share in the thread
+    std::unique_ptr<juce::SharedResourcePointer<BuildThread>> buildThread;
+    juce::CriticalSection buildLock;
+    TapSettings nextBuild;
+    bool hasNextBuild = false;
+    bool isBuilding = false;
+
+    std::atomic<PartitionedConvolution *> pending{nullptr};
+    std::atomic<PartitionedConvolution *> retired{nullptr};
+    PartitionedConvolution *current = nullptr;
+
+    JUCE_DECLARE_NON_COPYABLE(ConvolutionEngine)
+};
@@ -1,92 +1,202 @@
 #include "DelayBuffer.h"
 #include "Utils.h"
 
-DelayBuffer::DelayBuffer()
-    : delayBuffer(10, juce::Array<DelaySample>())
+DelayBuffer::Taps DelayBuffer::Taps::withSwing(float swing)
 {
+    Taps taps;
+    for (int rep = 0; rep < maxReps; ++rep)
+    {
+        taps.hopScales[rep] = rep % 2 == 0 ? 1.0f + swing : 1.0f - swing;
+    }
+    return taps;
+}
+
+void DelayBuffer::Taps::getOffsets(double *offsets, int delayReps) const
+{
+    jassert(delayReps <= maxReps);
+    double offset = 0.0;
+    for (int rep = 0; rep < delayReps; ++rep)
+    {
+        offset += hopScales[rep];
+        offsets[rep] = offset;
+    }
 }
 
-void DelayBuffer::setSize(int numSamples)
+bool DelayBuffer::Taps::operator==(const Taps &other) const
+{
+    return std::equal(std::begin(hopScales), std::end(hopScales), std::begin(other.hopScales));
+}
+
+DelayBuffer::DelayBuffer() = default;
+
+size_t DelayBuffer::getRequiredStorageSize(int numSamples)
 {
-    // resize the vector holding the juce::Array
     jassert(numSamples >= 0);
-    delayBuffer.resize(numSamples);
+    return static_cast<size_t>(numSamples) * maxReps;
+}
+
+void DelayBuffer::setStorage(float *storage, int newNumSamples)
+{
+    jassert(newNumSamples >= 0);
+    jassert(storage != nullptr || newNumSamples == 0);
+    data = storage;
+    numSamples = newNumSamples;
     writePosition = 0;
 }
 
+void DelayBuffer::resize(float *newStorage, int capacity, int newNumSamples, double resampleRatio)
+{
+    jassert(newStorage != nullptr);
+    jassert(newNumSamples > 0 && newNumSamples <= capacity);
+    jassert(resampleRatio > 0.0);
+    if (data == nullptr || numSamples == 0)
+    {
+        std::fill(newStorage, newStorage + getRequiredStorageSize(newNumSamples), 0.0f);
+        setStorage(newStorage, newNumSamples);
+        return;
+    }
+    // Put the history in chronological order, oldest sample first
+    std::rotate(data, getSlot(writePosition), getSlot(numSamples));
+
+    // Keep as much of the most recent history as fits once resampled. One slot is held
+    // back so that the resampled history never catches up with what is still to be read
+    // when resizing in place.
+    const int numToKeep = juce::jmin(numSamples, static_cast<int>((newNumSamples - 1) / resampleRatio));
+    const int numResampled = juce::jmin(newNumSamples - 1, static_cast<int>(numToKeep * resampleRatio));
+    const float *source = getSlot(numSamples - numToKeep);
+    // Park the history at the end of the storage so it can be resampled from the start.
+    // When the buffer already fills the storage it is parked there already.
+    float *storageEnd = newStorage + getRequiredStorageSize(capacity);
+    if (newStorage == data && storageEnd != getSlot(numSamples))
+    {
+        source = std::copy_backward(getSlot(numSamples - numToKeep), getSlot(numSamples), storageEnd);
+    }
+
+    // Line the resampled history up so that the newest sample is still just behind the write-position
+    for (int i = 0; i < numResampled; ++i)
+    {
+        const double position = juce::jmax(0.0, numToKeep - (numResampled - i) / resampleRatio);
+        const int floorIndex = juce::jmin(static_cast<int>(position), numToKeep - 1);
+        const int ceilIndex = juce::jmin(floorIndex + 1, numToKeep - 1);
+        const auto fraction = static_cast<float>(position - floorIndex);
+        const float *slotF = source + static_cast<size_t>(floorIndex) * maxReps;
+        const float *slotC = source + static_cast<size_t>(ceilIndex) * maxReps;
+        float *slotW = newStorage + static_cast<size_t>(i) * maxReps;
+        for (int rep = 0; rep < maxReps; ++rep)
+        {
+            slotW[rep] = slotF[rep] + fraction * (slotC[rep] - slotF[rep]);
+        }
+    }
+    std::fill(newStorage + getRequiredStorageSize(numResampled), newStorage + getRequiredStorageSize(newNumSamples), 0.0f);
+
+    data = newStorage;
+    numSamples = newNumSamples;
+    writePosition = numResampled % numSamples;
+}
+
 void DelayBuffer::writeFrom(const juce::AudioBuffer<float> &inputBuffer, int inputChannel)
 {
     jassert(inputChannel >= 0);
-    // The way this works, is that we are writing to the delay buffer, which is a vector of juce::Arrays.
-    // Each juce::Array represents the output for a sample.
-    // Each entry in a juce::Array is a delayed sample with an associated delay number.
-    // Thus, for each sample in the inputBuffer, we will go to the corresponding juce::Array in the delayBuffer
-    // and add the sample to the juce::Array with the appropriate delay number.
     jassert(inputBuffer.getNumChannels() > inputChannel);
-    // loop through all the samples in the inputBuffer
+    jassert(data != nullptr);
+    // Each input sample goes into the first slot of its position. The other
+    // slots of that position are left alone, they are filled by addTo.
+    const float *input = inputBuffer.getReadPointer(inputChannel);
     for (int sample = 0; sample < inputBuffer.getNumSamples(); ++sample)
     {
-        // get the input sample
-        float inputSample = inputBuffer.getSample(inputChannel, sample);
-        // get the delay buffer for the current sample
-        juce::Array<DelaySample> &delayBufferForSample = delayBuffer[writePosition];
+        getSlot(writePosition)[0] = input[sample];
         // update the write-position
-        writePosition = (writePosition + 1) % delayBuffer.size();
-        DelaySample ds = DelaySample(inputSample);
-        delayBufferForSample.add(ds);
+        writePosition = (writePosition + 1) % numSamples;
     }
 }
 
-void DelayBuffer::addTo(juce::AudioBuffer<float> &outputBuffer, int outputChannel, int delayReps, const juce::Array<std::atomic<float> *> repGains, Smoother<float> &delaySizeInSamples)
+DelayBuffer::ReadOffsets DelayBuffer::getReadOffsets(float delayInSamples, const Taps &taps, int numReps) const
+{
+    jassert(numSamples > 2);
+    double tapOffsets[maxReps] = {};
+    taps.getOffsets(tapOffsets, numReps);
+    ReadOffsets offsets;
+    // A rep is queued up for the next one from the sample before its read position, which can
+    // be up to a sample later than the rep was heard. Each hop is measured from where the rep
+    // was queued up rather than from the last hop, so that rep r is still heard exactly
+    // tapOffsets[r] delay times after the input, just like in the convolution engine.
+    int queuedAt = 0;
+    for (int rep = 0; rep < numReps; ++rep)
+    {
+        // At least one sample back so it never reads the write slot, and never further back
+        // than the buffer goes. The smoothed delay time can overshoot its target for a sample
+        // or two, which would otherwise take a delay at the longest time past the end.
+        const double hop = juce::jlimit(1.0, static_cast<double>(numSamples - 2), tapOffsets[rep] * delayInSamples - queuedAt);
+        offsets.whole[rep] = static_cast<int>(std::ceil(hop));
+        offsets.fraction[rep] = static_cast<float>(offsets.whole[rep] - hop);
+        queuedAt += offsets.whole[rep];
+    }
+    return offsets;
+}
+
+void DelayBuffer::addTo(juce::AudioBuffer<float> &outputBuffer, int outputChannel, int delayReps, const juce::Array<std::atomic<float> *> &repGains, Smoother<float> &delaySizeInSamples, const Taps &taps)
 {
     jassert(outputChannel >= 0);
+    jassert(data != nullptr);
+    const int numReps = juce::jlimit(0, maxReps, delayReps);
+    jassert(repGains.size() >= numReps);
+    // The gains only change between blocks
+    float gains[maxReps] = {};
+    for (int rep = 0; rep < numReps; ++rep)
+    {
+        gains[rep] = *repGains[rep];
+    }
+    const int numBlockSamples = outputBuffer.getNumSamples();
+    // writeFrom has already moved the write-position past this block, so step
+    // back to the position the first sample of the block was written to
+    const int blockStart = (writePosition - numBlockSamples % numSamples + numSamples) % numSamples;
+    float *output = outputBuffer.getWritePointer(outputChannel);
+    // The read offsets only change while the delay time is gliding, so they are
+    // worked out again when it moves rather than for every rep of every sample
+    float offsetsDelay = -1.0f;
+    ReadOffsets offsets;
     // loop through all the samples in the outputBuffer
-    for (int sample = 0; sample < outputBuffer.getNumSamples(); ++sample)
+    for (int sample = 0; sample < numBlockSamples; ++sample)
     {
-        // get the output sample
-        float outputSample = outputBuffer.getSample(outputChannel, sample);
-        // get the read position
-        double readPosition = writePosition + sample - delaySizeInSamples.getVal();
-        if (readPosition < 0)
+        float outputSample = output[sample];
+        const int currentPosition = (blockStart + sample) % numSamples;
+        const float delay = delaySizeInSamples.getVal();
+        if (delay != offsetsDelay)
         {
-            readPosition += delayBuffer.size();
+            offsets = getReadOffsets(delay, taps, numReps);
+            offsetsDelay = delay;
         }
-        readPosition = std::fmod(readPosition, delayBuffer.size());
-        // linear interpolation of the read position
-        const auto readPositionFloor = std::floor(readPosition);
-        auto rPF = static_cast<unsigned long>(readPositionFloor);
-        auto rPC = static_cast<unsigned long>(readPositionFloor + 1);
-        rPC = rPC % delayBuffer.size();
-        auto readPositionFraction = readPosition - readPositionFloor;
-        // juce::Array<DelaySample> &delayBufferForSample = delayBuffer[rPF] + readPositionFraction * (delayBuffer[rPC] - delayBuffer[rPF]);
-        juce::Array<DelaySample> &delayBufferForSampleF = delayBuffer[rPF];
-        juce::Array<DelaySample> &delayBufferForSampleC = delayBuffer[rPC];
-        // iterate over the delay buffer for the current sample
-        int initialSize = delayBufferForSampleF.size();
-        for (int i = 0; i < initialSize; i++)
+        float *slotW = getSlot(currentPosition);
+        for (int rep = 0; rep < maxReps; ++rep)
         {
-            auto delaySampleF = delayBufferForSampleF.removeAndReturn(0);
-            if (delaySampleF.reps < delayReps)
+            float next = 0.0f;
+            if (rep < numReps)
             {
-                float sampleAndGainF = delaySampleF.sample * (*repGains[delaySampleF.reps]);
-                outputSample += sampleAndGainF;
-                // Get the ceil Delay Sample
-                if (i < delayBufferForSampleC.size())
+                jassert(offsets.whole[rep] < numSamples);
+                // linear interpolation between the two samples either side of the read position
+                int rPF = currentPosition - offsets.whole[rep];
+                if (rPF < 0)
                 {
-                    auto delaySampleC = delayBufferForSampleC[i];
-                    if (delaySampleC.reps < delayReps)
-                    {
-                        float sampleAndGainC = delaySampleC.sample * (*repGains[delaySampleC.reps]);
-                        outputSample += readPositionFraction * (sampleAndGainC - sampleAndGainF);
-                    }
+                    rPF += numSamples;
                 }
-                // increment the number of repetitions
-                delaySampleF.reps++;
-                unsigned long wp = (writePosition + sample) % delayBuffer.size();
-                delayBuffer[wp].add(delaySampleF);
+                const int rPC = rPF + 1 == numSamples ? 0 : rPF + 1;
+                float *slotF = getSlot(rPF);
+                const float *slotC = getSlot(rPC);
+
+                const float delayedF = slotF[rep];
+                slotF[rep] = 0.0f;
+                const float sampleAndGainF = delayedF * gains[rep];
+                const float sampleAndGainC = slotC[rep] * gains[rep];
+                outputSample += sampleAndGainF + offsets.fraction[rep] * (sampleAndGainC - sampleAndGainF);
+                // this repetition has been heard, queue it up for the next one
+                next = delayedF;
+            }
+            if (rep + 1 < maxReps)
+            {
+                slotW[rep + 1] = next;
             }
         }
-        outputBuffer.setSample(outputChannel, sample, outputSample);
+        output[sample] = outputSample;
     }
 }
 
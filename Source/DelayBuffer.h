@@ -1,41 +1,65 @@
 // make a delay buffer class
-// This is similar to a juce::AudioBuffer, but it will store a struct called
-// a DelaySample. A DelaySample will be a float and an int. The float will
-// be the sample value and the int will be how many more times to apply the delay.
+// For every sample position the buffer stores one value per repetition.
+// Slot 0 holds the dry input that was written at that position, slot r holds
+// audio that has already been repeated r times and is waiting for its next
+// repetition.
+// The DelayBuffer does not own its memory. The processor allocates one
+// contiguous block in prepareToPlay and hands each channel a view into it.
 // The DelayBuffer will also be able to keep track of the write-position
 
 #pragma once
-#include <vector>
+#include <algorithm>
 #include <juce_audio_processors/juce_audio_processors.h>
 #include "Utils.h"
 
-struct DelaySample
-{
-    float sample;
-    int reps;
-    DelaySample() : sample(0), reps(0) {}
-    DelaySample(float sampleVal) : sample(sampleVal), reps(0) {}
-    DelaySample(const DelaySample &other) = default;
-    DelaySample &operator=(const DelaySample &other)
-    {
-        if (this != &other)
-        {
-            sample = other.sample;
-            reps = other.reps;
-        }
-        return *this;
-    }
-};
 class DelayBuffer
 {
 public:
+    // The maximum number of repetitions a sample can go through
+    static constexpr int maxReps = 5;
+
+    // How far apart the repetitions are, as multiples of the delay time.
+    // Rep r is heard hopScales[r] delay times after rep r - 1 (or the input).
+    // addTo turns this into read offsets in samples whenever the delay time changes.
+    struct Taps
+    {
+        float hopScales[maxReps] = {1.0f, 1.0f, 1.0f, 1.0f, 1.0f};
+
+        // Swing pushes every odd rep back by swing delay times, the even reps stay on the grid
+        static Taps withSwing(float swing);
+        // How many delay times after the input each of the first delayReps reps lands
+        void getOffsets(double *offsets, int delayReps) const;
+        bool operator==(const Taps &other) const;
+        bool operator!=(const Taps &other) const { return !(*this == other); }
+    };
+
     DelayBuffer();
     ~DelayBuffer();
-    void setSize(int numSamples);
+    // The number of floats needed to back a delay buffer of numSamples
+    static size_t getRequiredStorageSize(int numSamples);
+    // Point the buffer at storage holding getRequiredStorageSize(numSamples) floats
+    void setStorage(float *storage, int numSamples);
+    // Move the buffer to storage holding getRequiredStorageSize(capacity) floats while keeping
+    // the most recent history, resampled by resampleRatio (new sample rate / old sample rate).
+    // The storage may be the buffer's current storage as long as it has room for capacity.
+    void resize(float *newStorage, int capacity, int newNumSamples, double resampleRatio);
+    int getNumSamples() const { return numSamples; }
     void writeFrom(const juce::AudioBuffer<float> &inputBuffer, int inputChannel);
-    void addTo(juce::AudioBuffer<float> &outputBuffer, int outputChannel, int delayReps, const juce::Array<std::atomic<float> *> repGains, Smoother<float> &delaySizeInSamples);
+    void addTo(juce::AudioBuffer<float> &outputBuffer, int outputChannel, int delayReps, const juce::Array<std::atomic<float> *> &repGains, Smoother<float> &delaySizeInSamples, const Taps &taps);
 
 private:
-    std::vector<juce::Array<DelaySample>> delayBuffer;
+    // How far back each rep reads from: whole samples back from the current position,
+    // and how far the read position sits from there towards the next sample
+    struct ReadOffsets
+    {
+        int whole[maxReps] = {};
+        float fraction[maxReps] = {};
+    };
+    ReadOffsets getReadOffsets(float delayInSamples, const Taps &taps, int numReps) const;
+
+    float *getSlot(int position) const { return data + static_cast<size_t>(position) * maxReps; }
+
+    float *data = nullptr;
+    int numSamples = 0;
     int writePosition = 0;
 };
@@ -17,6 +17,13 @@ DelayThingEditor::DelayThingEditor(DelayThingAudioProcessor &p)
     {
         addAndMakeVisible(*slider);
     }
+
+    delayEngineBoxAttachment = attachChoice(delayEngineBox, processorRef.delayEngineParamName);
+    delayDivisionBoxAttachment = attachChoice(delayDivisionBox, processorRef.delayDivisionParamName);
+    delayFeelBoxAttachment = attachChoice(delayFeelBox, processorRef.delayFeelParamName);
+    addAndMakeVisible(delaySyncButton);
+    addAndMakeVisible(delaySwingSlider);
+
     // int delayReps = static_cast<int>(*p.delayReps);
     // for (int i = 0; i < delayReps; i++)
     // {
@@ -26,7 +33,17 @@ DelayThingEditor::DelayThingEditor(DelayThingAudioProcessor &p)
     // Start the timer
     float fps = 24.f; // frames per second
     startTimer(static_cast<int>(1000.f / fps));
-    setSize(400, 300);
+    setSize(560, 300);
+}
+
+std::unique_ptr<juce::AudioProcessorValueTreeState::ComboBoxAttachment> DelayThingEditor::attachChoice(juce::ComboBox &box, const juce::String &parameterID)
+{
+    if (auto *choiceParameter = dynamic_cast<juce::AudioParameterChoice *>(processorRef.getValueTreeState().getParameter(parameterID)))
+    {
+        box.addItemList(choiceParameter->choices, 1);
+    }
+    addAndMakeVisible(box);
+    return std::make_unique<juce::AudioProcessorValueTreeState::ComboBoxAttachment>(processorRef.getValueTreeState(), parameterID, box);
 }
 
 DelayThingEditor::~DelayThingEditor()
@@ -45,7 +62,12 @@ void DelayThingEditor::resized()
     // This is generally where you'll want to lay out the positions of any
     // subcomponents in your editor..
     auto box = getLocalBounds().reduced(20);
-    box.removeFromBottom(40);
+    auto engineBox = box.removeFromBottom(40);
+    delayEngineBox.setBounds(engineBox.removeFromLeft(130).reduced(10, 8));
+    delaySyncButton.setBounds(engineBox.removeFromLeft(70).reduced(5, 8));
+    delayDivisionBox.setBounds(engineBox.removeFromLeft(80).reduced(5, 8));
+    delayFeelBox.setBounds(engineBox.removeFromLeft(100).reduced(5, 8));
+    delaySwingSlider.setBounds(engineBox.reduced(5, 8));
 
     const auto width = box.getWidth();
     const auto height = box.getHeight();
@@ -64,6 +86,13 @@ void DelayThingEditor::resized()
 
 void DelayThingEditor::timerCallback()
 {
+    // The delay time knob does nothing while the delay follows the host tempo
+    const bool synced = delaySyncButton.getToggleState();
+    delayTimeSlider.setEnabled(!synced);
+    delayDivisionBox.setEnabled(synced);
+    delayFeelBox.setEnabled(synced);
+    delaySwingSlider.setEnabled(synced);
+
     int delayReps = static_cast<int>(*processorRef.delayReps);
     if (delayReps != lastDelayRepsValue)
     {
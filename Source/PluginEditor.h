@@ -33,6 +33,15 @@ private:
     juce::Slider delayGainSlider5{juce::Slider::LinearVertical, juce::Slider::TextBoxBelow};
     juce::Array<juce::Slider *> delayGainSliders{&delayGainSlider1, &delayGainSlider2, &delayGainSlider3, &delayGainSlider4, &delayGainSlider5};
 
+    // Picks between the direct and the convolution engine
+    juce::ComboBox delayEngineBox;
+
+    // Tempo sync controls
+    juce::ToggleButton delaySyncButton{"Sync"};
+    juce::ComboBox delayDivisionBox;
+    juce::ComboBox delayFeelBox;
+    juce::Slider delaySwingSlider{juce::Slider::LinearHorizontal, juce::Slider::TextBoxRight};
+
     juce::AudioProcessorValueTreeState::SliderAttachment delayTimeKnobAttachment{processorRef.getValueTreeState(), processorRef.delayTimeParamName, delayTimeSlider};
     juce::AudioProcessorValueTreeState::SliderAttachment delayMixKnobAttachment{processorRef.getValueTreeState(), processorRef.delayMixParamName, delayMixSlider};
     juce::AudioProcessorValueTreeState::SliderAttachment delayRepsKnobAttachment{processorRef.getValueTreeState(), processorRef.delayRepsParamName, delayRepsSlider};
@@ -42,4 +51,13 @@ private:
     juce::AudioProcessorValueTreeState::SliderAttachment delayGainKnobAttachment3{processorRef.getValueTreeState(), processorRef.delayRepGain3ParamName, delayGainSlider3};
     juce::AudioProcessorValueTreeState::SliderAttachment delayGainKnobAttachment4{processorRef.getValueTreeState(), processorRef.delayRepGain4ParamName, delayGainSlider4};
     juce::AudioProcessorValueTreeState::SliderAttachment delayGainKnobAttachment5{processorRef.getValueTreeState(), processorRef.delayRepGain5ParamName, delayGainSlider5};
+    juce::AudioProcessorValueTreeState::ButtonAttachment delaySyncButtonAttachment{processorRef.getValueTreeState(), processorRef.delaySyncParamName, delaySyncButton};
+    juce::AudioProcessorValueTreeState::SliderAttachment delaySwingSliderAttachment{processorRef.getValueTreeState(), processorRef.delaySwingParamName, delaySwingSlider};
+    // Created once the combo boxes have their items, so the attachments can select the right one
+    std::unique_ptr<juce::AudioProcessorValueTreeState::ComboBoxAttachment> delayEngineBoxAttachment;
+    std::unique_ptr<juce::AudioProcessorValueTreeState::ComboBoxAttachment> delayDivisionBoxAttachment;
+    std::unique_ptr<juce::AudioProcessorValueTreeState::ComboBoxAttachment> delayFeelBoxAttachment;
+
+    // Fills a combo box with a choice parameter's choices and attaches it
+    std::unique_ptr<juce::AudioProcessorValueTreeState::ComboBoxAttachment> attachChoice(juce::ComboBox &box, const juce::String &parameterID);
 };
\ No newline at end of file
@@ -11,7 +11,6 @@ DelayThingAudioProcessor::DelayThingAudioProcessor()
                          .withOutput("Output", juce::AudioChannelSet::stereo(), true)
 #endif
                          ),
-      delayBuffers(2),
       parameters(*this, &undoManager, juce::Identifier("DelayThingParameters"),
                  {
                      std::make_unique<juce::AudioParameterInt>(delayTimeParamName, "Time", 10, 2000, 200),
@@ -22,12 +21,16 @@ DelayThingAudioProcessor::DelayThingAudioProcessor()
                      std::make_unique<juce::AudioParameterFloat>(delayRepGain3ParamName, "Rep 3 Gain", 0.0f, 2.0f, 0.5f),
                      std::make_unique<juce::AudioParameterFloat>(delayRepGain4ParamName, "Rep 4 Gain", 0.0f, 2.0f, 0.5f),
                      std::make_unique<juce::AudioParameterFloat>(delayRepGain5ParamName, "Rep 5 Gain", 0.0f, 2.0f, 0.5f),
+                     std::make_unique<juce::AudioParameterChoice>(delayEngineParamName, "Engine", juce::StringArray{"Direct", "Convolution"}, 0),
+                     std::make_unique<juce::AudioParameterBool>(delaySyncParamName, "Sync", false),
+                     std::make_unique<juce::AudioParameterChoice>(delayDivisionParamName, "Division", juce::StringArray{"1/1", "1/2", "1/4", "1/8", "1/16", "1/32"}, 2),
+                     std::make_unique<juce::AudioParameterChoice>(delayFeelParamName, "Feel", juce::StringArray{"Straight", "Dotted", "Triplet"}, 0),
+                     std::make_unique<juce::AudioParameterFloat>(delaySwingParamName, "Swing", 0.0f, 0.5f, 0.0f),
                  }),
       repGains()
 {
-#if PERFETTO
-    MelatoninPerfetto::get().beginSession();
-#endif
+    // Keep the constructor cheap: tracing and the delay memory are set up in prepareToPlay
+    jassert(maxDelayReps <= DelayBuffer::maxReps);
     delayTime = parameters.getRawParameterValue(delayTimeParamName);
     jassert(delayTime != nullptr);
     parameters.addParameterListener(delayTimeParamName, this);
@@ -43,19 +46,35 @@ DelayThingAudioProcessor::DelayThingAudioProcessor()
     repGains.set(0, parameters.getRawParameterValue(delayRepGain1ParamName));
     parameters.addParameterListener(delayRepGain1ParamName, this);
     repGains.set(1, parameters.getRawParameterValue(delayRepGain2ParamName));
-    parameters.addParameterListener(delayRepGain1ParamName, this);
+    parameters.addParameterListener(delayRepGain2ParamName, this);
     repGains.set(2, parameters.getRawParameterValue(delayRepGain3ParamName));
-    parameters.addParameterListener(delayRepGain1ParamName, this);
+    parameters.addParameterListener(delayRepGain3ParamName, this);
     repGains.set(3, parameters.getRawParameterValue(delayRepGain4ParamName));
-    parameters.addParameterListener(delayRepGain1ParamName, this);
+    parameters.addParameterListener(delayRepGain4ParamName, this);
     repGains.set(4, parameters.getRawParameterValue(delayRepGain5ParamName));
-    parameters.addParameterListener(delayRepGain1ParamName, this);
+    parameters.addParameterListener(delayRepGain5ParamName, this);
+
+    delayEngine = parameters.getRawParameterValue(delayEngineParamName);
+    jassert(delayEngine != nullptr);
+    parameters.addParameterListener(delayEngineParamName, this);
+
+    // The sync parameters are picked up once per block in updateTaps, they don't need listeners
+    delaySync = parameters.getRawParameterValue(delaySyncParamName);
+    jassert(delaySync != nullptr);
+    delayDivision = parameters.getRawParameterValue(delayDivisionParamName);
+    jassert(delayDivision != nullptr);
+    delayFeel = parameters.getRawParameterValue(delayFeelParamName);
+    jassert(delayFeel != nullptr);
+    delaySwing = parameters.getRawParameterValue(delaySwingParamName);
+    jassert(delaySwing != nullptr);
 }
 
 DelayThingAudioProcessor::~DelayThingAudioProcessor()
 {
+    stopTimer();
 #if PERFETTO
-    MelatoninPerfetto::get().endSession();
+    if (tracingStarted)
+        MelatoninPerfetto::get().endSession();
 #endif
 };
 
@@ -121,57 +140,221 @@ const juce::String DelayThingAudioProcessor::getProgramName(int index)
 
 void DelayThingAudioProcessor::setDelayBufferSize(int numChannels, int numSamples)
 {
+    jassert(numChannels >= 0);
+    // All channels share one contiguous block, each delay buffer is a view into its part of it
+    const auto samplesPerChannel = DelayBuffer::getRequiredStorageSize(numSamples);
+    delayMemory.assign(samplesPerChannel * static_cast<size_t>(numChannels), 0.0f);
+    delayBufferCapacity = numSamples;
     // The number of channels is the number of delay buffers
-    delayBuffers.resize(numChannels);
-    // the number of samples is the size of each delay buffer
-    for (auto &delayBuffer : delayBuffers)
+    delayBuffers.resize(static_cast<size_t>(numChannels));
+    for (size_t channel = 0; channel < delayBuffers.size(); ++channel)
     {
-        delayBuffer.setSize(numSamples);
+        delayBuffers[channel].setStorage(delayMemory.data() + channel * samplesPerChannel, numSamples);
     }
 }
 
+void DelayThingAudioProcessor::resizeDelayBuffers(int numSamples, double resampleRatio)
+{
+    if (numSamples <= delayBufferCapacity)
+    {
+        // The current block is big enough, resize every channel in place
+        const auto samplesPerChannel = DelayBuffer::getRequiredStorageSize(delayBufferCapacity);
+        for (size_t channel = 0; channel < delayBuffers.size(); ++channel)
+        {
+            delayBuffers[channel].resize(delayMemory.data() + channel * samplesPerChannel, delayBufferCapacity, numSamples, resampleRatio);
+        }
+        return;
+    }
+    // Grow geometrically so that a host stepping the sample rate up doesn't reallocate every time
+    const int newCapacity = juce::jmax(numSamples, delayBufferCapacity + delayBufferCapacity / 2);
+    const auto samplesPerChannel = DelayBuffer::getRequiredStorageSize(newCapacity);
+    std::vector<float> newDelayMemory(samplesPerChannel * delayBuffers.size(), 0.0f);
+    for (size_t channel = 0; channel < delayBuffers.size(); ++channel)
+    {
+        delayBuffers[channel].resize(newDelayMemory.data() + channel * samplesPerChannel, newCapacity, numSamples, resampleRatio);
+    }
+    delayMemory.swap(newDelayMemory);
+    delayBufferCapacity = newCapacity;
+}
+
 void DelayThingAudioProcessor::changeProgramName(int index, const juce::String &newName)
 {
     juce::ignoreUnused(index, newName);
 }
 
-void DelayThingAudioProcessor::updateDelayBufferSizeInSamples(float delaySizeInMS)
+DelayBuffer::Taps DelayThingAudioProcessor::getCurrentTaps() const
 {
-    // calculate the new delay buffer size in samples
-    float newDelayBufferSizeInSamples = delaySizeInMS * (getSampleRate() / 1000.f);
-    // set the new delay buffer size in samples
-    delayBufferSizeInSamples.setTarget(newDelayBufferSizeInSamples);
+    // Swing only makes sense against the host's grid
+    return *delaySync >= 0.5f ? DelayBuffer::Taps::withSwing(*delaySwing) : DelayBuffer::Taps{};
+}
+
+void DelayThingAudioProcessor::updateTaps(bool readPlayHead)
+{
+    const double sampleRate = getSampleRate();
+    const auto newTaps = getCurrentTaps();
+    float newDelayInSamples = 0.0f;
+    if (*delaySync >= 0.5f)
+    {
+        // The play head only knows the tempo at the start of the block, so a
+        // tempo change takes effect from the first sample of the block it shows up in
+        if (auto *playHead = readPlayHead ? getPlayHead() : nullptr)
+        {
+            if (auto position = playHead->getPosition())
+            {
+                if (auto bpm = position->getBpm(); bpm.hasValue() && *bpm > 0.0)
+                    hostBpm = *bpm;
+            }
+        }
+        // 1/1 is a whole note, four beats, and every step down the list halves it
+        double beats = 4.0 / std::exp2(static_cast<int>(*delayDivision));
+        const int feel = static_cast<int>(*delayFeel);
+        if (feel == 1)
+            beats *= 1.5;
+        else if (feel == 2)
+            beats *= 2.0 / 3.0;
+        newDelayInSamples = static_cast<float>(beats * 60.0 / hostBpm * sampleRate);
+        // Slow tempos can ask for more than the delay buffer holds, keep the longest hop inside it
+        const float longestHop = *std::max_element(std::begin(newTaps.hopScales), std::end(newTaps.hopScales));
+        newDelayInSamples = juce::jmin(newDelayInSamples, static_cast<float>(maxDelaySeconds * sampleRate) / longestHop);
+    }
+    else
+    {
+        // calculate the new delay buffer size in samples
+        newDelayInSamples = *delayTime * static_cast<float>(sampleRate / 1000.0);
+    }
+
+    if (std::abs(newDelayInSamples - tapDelayInSamples.load()) > 0.01f || newTaps != taps)
+    {
+        taps = newTaps;
+        tapDelayInSamples = newDelayInSamples;
+        // set the new delay buffer size in samples
+        delayBufferSizeInSamples.setTarget(newDelayInSamples);
+        // The taps are moving, the convolution engine has to wait for them to settle
+        ++tapsVersion;
+    }
 }
 
 //==============================================================================
 void DelayThingAudioProcessor::prepareToPlay(double sampleRate, int samplesPerBlock)
 {
+#if PERFETTO
+    if (!tracingStarted)
+    {
+        MelatoninPerfetto::get().beginSession();
+        tracingStarted = true;
+    }
+#endif
     // we will need our buffer to be able to hold 2 seconds of audio data
     // First, get the number of samples in 2 seconds of audio (+ 2 blocks for safety)
-    int numSamples = (int)(2.0 * sampleRate) + (2 * samplesPerBlock);
+    int numSamples = (int)(maxDelaySeconds * sampleRate) + (2 * samplesPerBlock);
 
-    setDelayBufferSize(getTotalNumInputChannels(), numSamples);
+    // Re-preparing keeps the delay memory and what is still ringing out in it,
+    // only a change in the number of channels starts from scratch
+    const int numChannels = getTotalNumInputChannels();
+    if (preparedSampleRate <= 0.0 || delayBuffers.empty() || delayBuffers.size() != static_cast<size_t>(numChannels))
+    {
+        setDelayBufferSize(numChannels, numSamples);
+    }
+    else if (sampleRate != preparedSampleRate || numSamples != delayBuffers.front().getNumSamples())
+    {
+        resizeDelayBuffers(numSamples, sampleRate / preparedSampleRate);
+    }
+    preparedSampleRate = sampleRate;
 
     delayTime = parameters.getRawParameterValue(delayTimeParamName);
-    updateDelayBufferSizeInSamples(*delayTime);
-
-    // initialize the repGains
-    repGains.resize(maxDelayReps);
-    repGains.set(0, parameters.getRawParameterValue(delayRepGain1ParamName));
-    repGains.set(1, parameters.getRawParameterValue(delayRepGain2ParamName));
-    repGains.set(2, parameters.getRawParameterValue(delayRepGain3ParamName));
-    repGains.set(3, parameters.getRawParameterValue(delayRepGain4ParamName));
-    repGains.set(4, parameters.getRawParameterValue(delayRepGain5ParamName));
+    // Force the taps to be worked out again at the new sample rate
+    tapDelayInSamples = -1.0f;
+    updateTaps(false);
 
     delayBufferSizeInSamples.setDecay(0.02f, sampleRate);
+
+    // The impulse response depends on the sample rate, so the convolution engine
+    // steps aside until a new one has been built
+    drainBuffer.setSize(numChannels, juce::jmax(1, samplesPerBlock));
+    ++tapsVersion;
+    isPrepared = true;
+    updateTimer();
+}
+
+void DelayThingAudioProcessor::updateTimer()
+{
+    // Only the convolution engine has anything to do on the timer, it stops itself
+    // once the engine is switched back and whatever it swapped out has been freed
+    if (isPrepared && *delayEngine >= 0.5f && !isTimerRunning())
+        startTimerHz(20);
+}
+
+void DelayThingAudioProcessor::timerCallback()
+{
+    convolutionEngine.releaseRetired();
+    if (*delayEngine < 0.5f)
+    {
+        stopTimer();
+        return;
+    }
+    // Wait for the taps to stop moving before building an impulse response for them
+    const int version = tapsVersion.load();
+    const auto now = juce::Time::getMillisecondCounter();
+    if (version != lastSeenTapsVersion)
+    {
+        lastSeenTapsVersion = version;
+        tapsChangedAt = now;
+        return;
+    }
+    if (version != requestedTapsVersion && now - tapsChangedAt >= tapsSettleTimeMs)
+    {
+        updateImpulseResponse();
+    }
+}
+
+void DelayThingAudioProcessor::updateImpulseResponse()
+{
+    // Read the version first, if anything changes while the impulse response is
+    // being built it ends up tagged as out of date rather than the other way round
+    const int version = tapsVersion.load();
+    ConvolutionEngine::TapSettings settings;
+    settings.tapsVersion = version;
+    const int numReps = juce::jlimit(0, maxDelayReps, static_cast<int>(*delayReps));
+    for (int rep = 0; rep < numReps; ++rep)
+    {
+        settings.repGains.push_back(*repGains[rep]);
+    }
+    // The rep offsets come from the same table the direct engine uses
+    double offsets[DelayBuffer::maxReps] = {};
+    getCurrentTaps().getOffsets(offsets, numReps);
+    const double delayInSamples = tapDelayInSamples.load();
+    for (int rep = 0; rep < numReps; ++rep)
+    {
+        settings.tapOffsets.push_back(offsets[rep] * delayInSamples);
+    }
+    settings.partitionSize = juce::nextPowerOfTwo(juce::jmax(64, getBlockSize()));
+    settings.numChannels = getTotalNumInputChannels();
+    // The impulse response and its spectra can run to megabytes, they're built in the background
+    convolutionEngine.build(std::move(settings));
+    requestedTapsVersion = version;
+}
+
+void DelayThingAudioProcessor::waitForImpulseResponse()
+{
+    convolutionEngine.waitForBuild();
 }
 
 void DelayThingAudioProcessor::parameterChanged(const juce::String &parameterID, float newValue)
 {
-    if (parameterID == delayTimeParamName)
+    if (parameterID == delayTimeParamName || parameterID == delayRepsParamName || parameterID.startsWith("delayRepGain"))
     {
+        // The taps are moving, the convolution engine has to wait for them to settle
+        ++tapsVersion;
+    }
+
+    if (parameterID == delayEngineParamName)
+    {
+        updateTimer();
+    }
+    else if (parameterID == delayTimeParamName)
+    {
+        // The delay time in samples is worked out on the audio thread, see updateTaps
         *delayTime = newValue;
-        updateDelayBufferSizeInSamples(*delayTime);
     }
     else if (parameterID == delayMixParamName)
     {
@@ -212,6 +395,8 @@ void DelayThingAudioProcessor::releaseResources()
 {
     // When playback stops, you can use this as an opportunity to free up any
     // spare memory, etc.
+    isPrepared = false;
+    stopTimer();
 }
 
 bool DelayThingAudioProcessor::isBusesLayoutSupported(const BusesLayout &layouts) const
@@ -254,15 +439,70 @@ void DelayThingAudioProcessor::processBlock(juce::AudioBuffer<float> &buffer,
     // this code if your algorithm always overwrites all the output channels.
     for (auto i = totalNumInputChannels; i < totalNumOutputChannels; ++i)
         buffer.clear(i, 0, buffer.getNumSamples());
+    const int numSamples = buffer.getNumSamples();
+    updateTaps(true);
+
+    // The convolution engine only runs while its impulse response matches the
+    // current delay settings, so any automation falls back to the direct engine
+    if (!convolutionActive && convolutionTailRemaining == 0)
+        convolutionEngine.swapInPending();
+    auto *convolution = convolutionEngine.getCurrent();
+    const bool useConvolution = *delayEngine >= 0.5f && convolution != nullptr && convolution->getTapsVersion() == tapsVersion.load();
+    if (useConvolution != convolutionActive)
+    {
+        // New input only goes to the engine taking over, the other one
+        // lets the echoes it already has in flight ring out on silence
+        if (useConvolution)
+        {
+            const int numReps = juce::jlimit(0, maxDelayReps, static_cast<int>(*delayReps));
+            double offsets[DelayBuffer::maxReps] = {};
+            taps.getOffsets(offsets, numReps);
+            const double lastOffset = numReps > 0 ? offsets[numReps - 1] : 0.0;
+            directTailRemaining = static_cast<int>(std::ceil(lastOffset * tapDelayInSamples.load())) + numSamples;
+        }
+        else
+        {
+            convolutionTailRemaining = convolution->getTailLength();
+        }
+        convolutionActive = useConvolution;
+    }
+
     // This is the main audio processing loop
+    jassert(delayBuffers.size() >= static_cast<size_t>(totalNumInputChannels));
     for (int channel = 0; channel < totalNumInputChannels; ++channel)
     {
-        // Throw an error if the size of the buffer is larger than the delayBufferSizeInSamples
-        // add the channel data to the delay buffer
-        delayBuffers[channel].writeFrom(buffer, channel);
-        // read from the delay buffer
-        delayBuffers[channel].addTo(buffer, channel, *delayReps, repGains, delayBufferSizeInSamples);
+        const bool convolutionHasChannel = convolution != nullptr && channel < convolution->getNumChannels();
+        if (convolutionActive)
+        {
+            if (convolutionHasChannel)
+                convolution->process(buffer.getReadPointer(channel), buffer.getWritePointer(channel), numSamples, channel);
+            // The drain buffer is only as big as prepareToPlay said the blocks would be,
+            // bigger blocks are drained a piece at a time rather than growing it here
+            for (int start = 0; directTailRemaining > 0 && start < numSamples; start += drainBuffer.getNumSamples())
+            {
+                const int numToDrain = juce::jmin(drainBuffer.getNumSamples(), numSamples - start);
+                juce::AudioBuffer<float> drain(drainBuffer.getArrayOfWritePointers(), drainBuffer.getNumChannels(), numToDrain);
+                drain.clear(channel, 0, numToDrain);
+                delayBuffers[channel].writeFrom(drain, channel);
+                delayBuffers[channel].addTo(drain, channel, *delayReps, repGains, delayBufferSizeInSamples, taps);
+                buffer.addFrom(channel, start, drain, channel, 0, numToDrain);
+            }
+        }
+        else
+        {
+            // Throw an error if the size of the buffer is larger than the delayBufferSizeInSamples
+            // add the channel data to the delay buffer
+            delayBuffers[channel].writeFrom(buffer, channel);
+            // read from the delay buffer
+            delayBuffers[channel].addTo(buffer, channel, *delayReps, repGains, delayBufferSizeInSamples, taps);
+            if (convolutionTailRemaining > 0 && convolutionHasChannel)
+                convolution->process(nullptr, buffer.getWritePointer(channel), numSamples, channel);
+        }
     }
+    if (convolutionActive)
+        directTailRemaining = juce::jmax(0, directTailRemaining - numSamples);
+    else
+        convolutionTailRemaining = juce::jmax(0, convolutionTailRemaining - numSamples);
 }
 
 //==============================================================================
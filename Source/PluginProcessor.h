@@ -2,11 +2,12 @@
 
 #include <juce_audio_processors/juce_audio_processors.h>
 #include <melatonin_perfetto/melatonin_perfetto.h>
+#include "ConvolutionEngine.h"
 #include "DelayBuffer.h"
 #include "Utils.h"
 
 //==============================================================================
-class DelayThingAudioProcessor : public juce::AudioProcessor, public juce::AudioProcessorValueTreeState::Listener
+class DelayThingAudioProcessor : public juce::AudioProcessor, public juce::AudioProcessorValueTreeState::Listener, private juce::Timer
 {
 public:
     //==============================================================================
@@ -52,8 +53,21 @@ public:
     void parameterChanged(const juce::String &parameterID, float newValue) override;
 
     juce::AudioProcessorValueTreeState &getValueTreeState();
-    void updateDelayBufferSizeInSamples(float delaySizeInMS);
+    // Works out the delay time in samples and the rep spacing for the next block,
+    // from the host tempo when the delay is synced
+    void updateTaps(bool readPlayHead);
+    // The rep spacing the current parameters ask for
+    DelayBuffer::Taps getCurrentTaps() const;
     void setDelayBufferSize(int numChannels, int numSamples);
+    // Resize every delay buffer while keeping its history, see DelayBuffer::resize
+    void resizeDelayBuffers(int numSamples, double resampleRatio);
+    const std::vector<DelayBuffer> &getDelayBuffers() const { return delayBuffers; }
+    // Asks the convolution engine to build the impulse response for the current delay settings
+    void updateImpulseResponse();
+    // Blocks until the impulse response asked for last is ready for the audio thread to pick up
+    void waitForImpulseResponse();
+    // Whether the last block was rendered by the convolution engine
+    bool isConvolutionActive() const { return convolutionActive; }
 
     // The parameter name constants
     const juce::String delayTimeParamName = "delayTime";
@@ -65,17 +79,35 @@ public:
     const juce::String delayRepGain3ParamName = "delayRepGain3";
     const juce::String delayRepGain4ParamName = "delayRepGain4";
     const juce::String delayRepGain5ParamName = "delayRepGain5";
+    const juce::String delayEngineParamName = "delayEngine";
+    const juce::String delaySyncParamName = "delaySync";
+    const juce::String delayDivisionParamName = "delayDivision";
+    const juce::String delayFeelParamName = "delayFeel";
+    const juce::String delaySwingParamName = "delaySwing";
+    // The longest delay the delay buffer has room for
+    static constexpr double maxDelaySeconds = 2.0;
     // TODO: Decide if this makes sense for this to be public
     // The number of times each delay is repeated
     std::atomic<float> *delayReps = nullptr;
 
 private:
     //==============================================================================
+    void timerCallback() override;
+    // Runs the timer while the convolution engine is selected
+    void updateTimer();
+
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(DelayThingAudioProcessor)
+    // One contiguous block backing every channel's delay buffer, allocated in prepareToPlay
+    std::vector<float> delayMemory;
+    // The number of samples each channel's part of delayMemory has room for
+    int delayBufferCapacity = 0;
+    // The sample rate the delay buffers were last prepared at
+    double preparedSampleRate = 0.0;
     std::vector<DelayBuffer> delayBuffers;
     Smoother<float> delayBufferSizeInSamples = Smoother<float>(0.001f);
 #if PERFETTO
     std::unique_ptr<perfetto::TracingSession> tracingSession;
+    bool tracingStarted = false;
 #endif
     juce::UndoManager undoManager;
 
@@ -87,4 +119,38 @@ private:
     std::atomic<float> *delayMix = nullptr;
     // An array of the repGains for each delay
     juce::Array<std::atomic<float> *> repGains;
+    // 0 for the direct engine, 1 for the convolution engine. The convolution engine costs
+    // more than the direct one at every setting, nothing is built for it unless it's selected.
+    std::atomic<float> *delayEngine = nullptr;
+    // Whether the delay time follows the host tempo, and as what note
+    std::atomic<float> *delaySync = nullptr;
+    std::atomic<float> *delayDivision = nullptr;
+    std::atomic<float> *delayFeel = nullptr;
+    // How far every odd rep is pushed back, as a fraction of the delay time
+    std::atomic<float> *delaySwing = nullptr;
+
+    // The taps the direct engine is running, only touched on the audio thread
+    DelayBuffer::Taps taps;
+    // The delay time in samples the taps are spaced by, read by the message thread
+    std::atomic<float> tapDelayInSamples{-1.0f};
+    // The last tempo the host reported
+    double hostBpm = 120.0;
+
+    // How long the delay settings have to stay put before the convolution engine takes over
+    static constexpr juce::uint32 tapsSettleTimeMs = 250;
+    ConvolutionEngine convolutionEngine;
+    // Bumped every time something that shapes the taps changes
+    std::atomic<int> tapsVersion{0};
+    // Message thread state for deciding when to build a new impulse response
+    int lastSeenTapsVersion = 0;
+    int requestedTapsVersion = -1;
+    juce::uint32 tapsChangedAt = 0;
+    // Whether the processor is between prepareToPlay and releaseResources, read by the parameter listener
+    std::atomic<bool> isPrepared{false};
+    // Audio thread state for handing over between the engines
+    bool convolutionActive = false;
+    int directTailRemaining = 0;
+    int convolutionTailRemaining = 0;
+    // Silence for the direct engine to ring out on while the convolution engine runs
+    juce::AudioBuffer<float> drainBuffer;
 };
\ No newline at end of file
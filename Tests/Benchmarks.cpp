@@ -0,0 +1,147 @@
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <catch2/catch_test_macros.hpp>
+
+#include "PluginProcessor.h"
+
+// Benchmarks are hidden from the default run, use `./Tests "[benchmark]"` to run them
+
+TEST_CASE("Plugin instantiation", "[.benchmark]")
+{
+    auto gui = juce::ScopedJuceInitialiser_GUI{};
+
+    BENCHMARK("construct + prepare one instance")
+    {
+        DelayThingAudioProcessor delayThing;
+        delayThing.prepareToPlay(48000.0, 512);
+        return delayThing.getDelayBuffers().size();
+    };
+
+    BENCHMARK("construct + prepare 500 instances")
+    {
+        std::vector<std::unique_ptr<DelayThingAudioProcessor>> instances;
+        instances.reserve(500);
+        for (int i = 0; i < 500; ++i)
+        {
+            instances.push_back(std::make_unique<DelayThingAudioProcessor>());
+            instances.back()->prepareToPlay(48000.0, 512);
+        }
+        return instances.size();
+    };
+}
+
+TEST_CASE("Re-preparing a running instance", "[.benchmark]")
+{
+    auto gui = juce::ScopedJuceInitialiser_GUI{};
+    DelayThingAudioProcessor delayThing;
+    delayThing.prepareToPlay(48000.0, 512);
+
+    BENCHMARK("same settings")
+    {
+        delayThing.prepareToPlay(48000.0, 512);
+        return delayThing.getDelayBuffers().size();
+    };
+
+    BENCHMARK("block size change")
+    {
+        delayThing.prepareToPlay(48000.0, 256);
+        delayThing.prepareToPlay(48000.0, 512);
+        return delayThing.getDelayBuffers().size();
+    };
+
+    BENCHMARK("sample rate change")
+    {
+        delayThing.prepareToPlay(96000.0, 512);
+        delayThing.prepareToPlay(48000.0, 512);
+        return delayThing.getDelayBuffers().size();
+    };
+}
+
+TEST_CASE("Direct taps vs partitioned convolution", "[.benchmark]")
+{
+    auto gui = juce::ScopedJuceInitialiser_GUI{};
+    // The plugin's impulse responses run from 10ms (one rep of the shortest delay time) up to
+    // 10 seconds (5 reps of 2000ms) at 48kHz, processed in 512 sample blocks. The direct cost
+    // grows with the number of taps while the convolution cost grows with the length, so every
+    // length has its own tap count where the convolution gets ahead.
+    const int blockSize = 512;
+    const int numBlocks = 20;
+    juce::AudioBuffer<float> input(1, blockSize);
+    juce::Random random(1);
+    for (int sample = 0; sample < blockSize; ++sample)
+        input.setSample(0, sample, random.nextFloat() * 2.0f - 1.0f);
+
+    for (int irLength : {480, 19200, 96000, 480000})
+    {
+        const auto length = std::to_string(irLength) + " samples";
+        for (int numTaps : {1, 5, 20, 100, 500, 1000})
+        {
+            std::vector<int> tapOffsets;
+            for (int tap = 1; tap <= numTaps; ++tap)
+                tapOffsets.push_back(tap * (irLength - 1) / numTaps);
+
+            std::vector<float> history(static_cast<size_t>(irLength), 0.0f);
+            int writePosition = 0;
+            juce::AudioBuffer<float> output(1, blockSize);
+            BENCHMARK("direct, " + std::to_string(numTaps) + " taps over " + length)
+            {
+                for (int block = 0; block < numBlocks; ++block)
+                {
+                    const float *in = input.getReadPointer(0);
+                    float *out = output.getWritePointer(0);
+                    for (int sample = 0; sample < blockSize; ++sample)
+                    {
+                        history[static_cast<size_t>(writePosition)] = in[sample];
+                        float wet = 0.0f;
+                        for (auto offset : tapOffsets)
+                            wet += 0.5f * history[static_cast<size_t>((writePosition - offset + irLength) % irLength)];
+                        out[sample] = in[sample] + wet;
+                        writePosition = (writePosition + 1) % irLength;
+                    }
+                }
+                return output.getSample(0, 0);
+            };
+        }
+
+        // The convolution cost doesn't depend on how many taps there are
+        std::vector<float> impulseResponse(static_cast<size_t>(irLength), 0.0f);
+        impulseResponse.back() = 0.5f;
+        PartitionedConvolution convolution(impulseResponse, blockSize, 1, 0);
+        juce::AudioBuffer<float> output(1, blockSize);
+        BENCHMARK("convolution over " + length)
+        {
+            for (int block = 0; block < numBlocks; ++block)
+            {
+                output.copyFrom(0, 0, input, 0, 0, blockSize);
+                convolution.process(input.getReadPointer(0), output.getWritePointer(0), blockSize, 0);
+            }
+            return output.getSample(0, 0);
+        };
+    }
+
+    // The plugin's longest case, 5 reps of 2000ms, through each engine
+    for (int engine : {0, 1})
+    {
+        DelayThingAudioProcessor delayThing;
+        auto &parameters = delayThing.getValueTreeState();
+        parameters.getParameter(delayThing.delayTimeParamName)->setValueNotifyingHost(1.0f);
+        parameters.getParameter(delayThing.delayRepsParamName)->setValueNotifyingHost(1.0f);
+        parameters.getParameter(delayThing.delayEngineParamName)->setValueNotifyingHost(static_cast<float>(engine));
+        delayThing.setRateAndBufferSizeDetails(48000.0, blockSize);
+        delayThing.prepareToPlay(48000.0, blockSize);
+        if (engine == 1)
+            delayThing.updateImpulseResponse();
+            delayThing.waitForImpulseResponse();
+        juce::AudioBuffer<float> stereo(2, blockSize);
+        juce::MidiBuffer midi;
+        BENCHMARK(std::string("DelayThing ") + (engine == 1 ? "convolution" : "direct") + " engine, 5 reps of 2000ms, stereo")
+        {
+            for (int block = 0; block < numBlocks; ++block)
+            {
+                stereo.copyFrom(0, 0, input, 0, 0, blockSize);
+                stereo.copyFrom(1, 0, input, 0, 0, blockSize);
+                delayThing.processBlock(stereo, midi);
+            }
+            return stereo.getSample(0, 0);
+        };
+    }
+}
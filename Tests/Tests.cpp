@@ -1,9 +1,70 @@
+#include <catch2/catch_approx.hpp>
 #include <catch2/catch_test_macros.hpp>
 
 // #include "catch.hpp" // You need to install Catch2 library to use this header
 
 #include "PluginProcessor.h"
 
+// The rep gains, delay time and tap spacing a DelayBuffer is driven with
+struct DelaySettings
+{
+    DelaySettings(float delayInSamples, std::initializer_list<float> gainValues, int numReps = 1)
+        : delayReps(numReps)
+    {
+        int rep = 0;
+        for (auto gain : gainValues)
+            gains[rep++] = gain;
+        for (auto &gain : gains)
+            repGains.add(&gain);
+        delaySize.setTarget(delayInSamples);
+    }
+
+    std::atomic<float> gains[DelayBuffer::maxReps] = {};
+    juce::Array<std::atomic<float> *> repGains;
+    Smoother<float> delaySize = Smoother<float>(1.0f);
+    int delayReps;
+    DelayBuffer::Taps taps;
+};
+
+// Processes numSamples through the delay buffer in blocks of blockSize and returns
+// what comes out. The first sample is an impulse unless withImpulse is false.
+static std::vector<float> processDelayBuffer(DelayBuffer &delayBuffer, DelaySettings &settings, int numSamples, int blockSize, bool withImpulse = true)
+{
+    std::vector<float> output;
+    juce::AudioBuffer<float> buffer(1, blockSize);
+    for (int processed = 0; processed < numSamples; processed += blockSize)
+    {
+        buffer.clear();
+        if (processed == 0 && withImpulse)
+            buffer.setSample(0, 0, 1.0f);
+        delayBuffer.writeFrom(buffer, 0);
+        delayBuffer.addTo(buffer, 0, settings.delayReps, settings.repGains, settings.delaySize, settings.taps);
+        output.insert(output.end(), buffer.getReadPointer(0), buffer.getReadPointer(0) + blockSize);
+    }
+    return output;
+}
+
+// Processes numSamples through the processor in blocks of blockSize and returns the first
+// channel. The first sample is an impulse on every channel unless withImpulse is false.
+static std::vector<float> processPlugin(DelayThingAudioProcessor &delayThing, int numSamples, int blockSize, bool withImpulse = true)
+{
+    std::vector<float> output;
+    juce::MidiBuffer midi;
+    juce::AudioBuffer<float> buffer(2, blockSize);
+    for (int processed = 0; processed < numSamples; processed += blockSize)
+    {
+        buffer.clear();
+        if (processed == 0 && withImpulse)
+        {
+            buffer.setSample(0, 0, 1.0f);
+            buffer.setSample(1, 0, 1.0f);
+        }
+        delayThing.processBlock(buffer, midi);
+        output.insert(output.end(), buffer.getReadPointer(0), buffer.getReadPointer(0) + blockSize);
+    }
+    return output;
+}
+
 TEST_CASE("writeToDelayBuffer writes samples to delay buffer", "[DelayThing]")
 {
     // DelayThingAudioProcessor delayThing;
@@ -37,3 +98,426 @@ TEST_CASE("writeToDelayBuffer writes samples to delay buffer", "[DelayThing]")
     // }
     REQUIRE(true);
 }
+
+TEST_CASE("DelayThingAudioProcessor defers delay memory to prepareToPlay", "[DelayThing]")
+{
+    auto gui = juce::ScopedJuceInitialiser_GUI{};
+    DelayThingAudioProcessor delayThing;
+    REQUIRE(delayThing.getDelayBuffers().empty());
+
+    delayThing.prepareToPlay(48000.0, 512);
+    REQUIRE(delayThing.getDelayBuffers().size() == 2);
+    REQUIRE(delayThing.getDelayBuffers()[0].getNumSamples() == 2 * 48000 + 2 * 512);
+}
+
+TEST_CASE("DelayBuffer repeats an impulse once per rep", "[DelayBuffer]")
+{
+    const int bufferSize = 1000;
+    const int delayInSamples = 100;
+
+    std::vector<float> storage(DelayBuffer::getRequiredStorageSize(bufferSize));
+    DelayBuffer delayBuffer;
+    delayBuffer.setStorage(storage.data(), bufferSize);
+    DelaySettings settings(delayInSamples, {0.5f, 0.25f, 0.125f, 1.0f, 1.0f}, 3);
+
+    // push an impulse through and collect everything that comes out
+    auto output = processDelayBuffer(delayBuffer, settings, 480, 32);
+
+    for (int i = 0; i < static_cast<int>(output.size()); ++i)
+    {
+        float expected = 0.0f;
+        if (i == 0)
+            expected = 1.0f;
+        else if (i == delayInSamples)
+            expected = 0.5f;
+        else if (i == 2 * delayInSamples)
+            expected = 0.25f;
+        else if (i == 3 * delayInSamples)
+            expected = 0.125f;
+        INFO("sample " << i);
+        REQUIRE(output[static_cast<size_t>(i)] == expected);
+    }
+}
+
+TEST_CASE("DelayBuffer resize keeps the history", "[DelayBuffer]")
+{
+    const int capacity = 2000;
+    std::vector<float> storage(DelayBuffer::getRequiredStorageSize(capacity));
+    DelayBuffer delayBuffer;
+    delayBuffer.setStorage(storage.data(), 1000);
+
+    DelaySettings settings(100, {0.5f, 0.5f, 0.5f, 0.5f, 0.5f});
+
+    SECTION("at the same sample rate")
+    {
+        processDelayBuffer(delayBuffer, settings, 40, 1);
+        delayBuffer.resize(storage.data(), capacity, 1100, 1.0);
+        REQUIRE(delayBuffer.getNumSamples() == 1100);
+
+        // the impulse is 40 samples old, so the echo is 60 samples away
+        auto output = processDelayBuffer(delayBuffer, settings, 200, 200, false);
+        for (int i = 0; i < 200; ++i)
+        {
+            INFO("sample " << i);
+            REQUIRE(output[static_cast<size_t>(i)] == (i == 60 ? 0.5f : 0.0f));
+        }
+    }
+
+    SECTION("at double the sample rate")
+    {
+        processDelayBuffer(delayBuffer, settings, 40, 1);
+        delayBuffer.resize(storage.data(), capacity, 2000, 2.0);
+        settings.delaySize.setTarget(200);
+
+        // the impulse is now 80 samples old, so the echo is 120 samples away
+        auto output = processDelayBuffer(delayBuffer, settings, 300, 300, false);
+        for (int i = 0; i < 300; ++i)
+        {
+            float expected = 0.0f;
+            if (i == 120)
+                expected = 0.5f;
+            else if (i == 119 || i == 121)
+                expected = 0.25f;
+            INFO("sample " << i);
+            REQUIRE(output[static_cast<size_t>(i)] == expected);
+        }
+    }
+
+    SECTION("when the buffer already fills the storage")
+    {
+        // prepareToPlay hands out exactly as much storage as the first buffer size needs
+        delayBuffer.setStorage(storage.data(), capacity);
+        processDelayBuffer(delayBuffer, settings, 40, 1);
+        delayBuffer.resize(storage.data(), capacity, 1500, 1.0);
+
+        auto output = processDelayBuffer(delayBuffer, settings, 200, 200, false);
+        for (int i = 0; i < 200; ++i)
+        {
+            INFO("sample " << i);
+            REQUIRE(output[static_cast<size_t>(i)] == (i == 60 ? 0.5f : 0.0f));
+        }
+    }
+
+    SECTION("into new storage")
+    {
+        processDelayBuffer(delayBuffer, settings, 40, 1);
+        std::vector<float> newStorage(DelayBuffer::getRequiredStorageSize(500));
+        delayBuffer.resize(newStorage.data(), 500, 500, 0.5);
+        settings.delaySize.setTarget(50);
+
+        // the impulse is now 20 samples old, so the echo is 30 samples away
+        auto output = processDelayBuffer(delayBuffer, settings, 100, 100, false);
+        for (int i = 0; i < 100; ++i)
+        {
+            INFO("sample " << i);
+            REQUIRE(output[static_cast<size_t>(i)] == (i == 30 ? 0.5f : 0.0f));
+        }
+    }
+}
+
+TEST_CASE("DelayThingAudioProcessor keeps ringing out across a block size change", "[DelayThing]")
+{
+    auto gui = juce::ScopedJuceInitialiser_GUI{};
+    DelayThingAudioProcessor delayThing;
+    delayThing.setRateAndBufferSizeDetails(48000.0, 512);
+    delayThing.prepareToPlay(48000.0, 512);
+    processPlugin(delayThing, 512, 512);
+
+    // the host switches to a smaller block size while the impulse is still in the buffer
+    delayThing.setRateAndBufferSizeDetails(48000.0, 256);
+    delayThing.prepareToPlay(48000.0, 256);
+    REQUIRE(delayThing.getDelayBuffers()[0].getNumSamples() == 2 * 48000 + 2 * 256);
+
+    // the default delay time is 200ms, so the first echo is 9600 samples after the impulse
+    const int echoPosition = 9600 - 512;
+    auto output = processPlugin(delayThing, echoPosition + 1, 256, false);
+    REQUIRE(output[echoPosition] == Catch::Approx(0.5f).margin(0.001f));
+}
+
+TEST_CASE("PartitionedConvolution matches direct convolution", "[ConvolutionEngine]")
+{
+    juce::Random random(1234);
+    std::vector<float> impulseResponse(1000);
+    for (auto &sample : impulseResponse)
+        sample = random.nextFloat() * 2.0f - 1.0f;
+    std::vector<float> input(700);
+    for (auto &sample : input)
+        sample = random.nextFloat() * 2.0f - 1.0f;
+
+    PartitionedConvolution convolution(impulseResponse, 64, 1, 0);
+    // process in uneven chunks so blocks get filled up over several calls
+    std::vector<float> output(input.size(), 0.0f);
+    const int chunkSizes[] = {1, 17, 64, 100, 3, 128, 200};
+    size_t position = 0;
+    for (int chunk = 0; position < input.size(); ++chunk)
+    {
+        const auto numSamples = juce::jmin(input.size() - position, static_cast<size_t>(chunkSizes[chunk % 7]));
+        convolution.process(input.data() + position, output.data() + position, static_cast<int>(numSamples), 0);
+        position += numSamples;
+    }
+
+    for (size_t i = 0; i < output.size(); ++i)
+    {
+        float expected = 0.0f;
+        for (size_t tap = 0; tap <= i && tap < impulseResponse.size(); ++tap)
+            expected += impulseResponse[tap] * input[i - tap];
+        INFO("sample " << i);
+        REQUIRE(output[i] == Catch::Approx(expected).margin(0.001f));
+    }
+}
+
+// Settings for a convolution with a single tap
+static ConvolutionEngine::TapSettings makeTapSettings(double tapOffset, int tapsVersion)
+{
+    ConvolutionEngine::TapSettings settings;
+    settings.tapOffsets = {tapOffset};
+    settings.repGains = {0.5f};
+    settings.partitionSize = 64;
+    settings.numChannels = 2;
+    settings.tapsVersion = tapsVersion;
+    return settings;
+}
+
+TEST_CASE("ConvolutionEngine builds in the background", "[ConvolutionEngine]")
+{
+    ConvolutionEngine engine;
+    // Builds asked for while another one is running are folded into the latest
+    for (int version = 1; version <= 5; ++version)
+        engine.build(makeTapSettings(100.0 * version, version));
+    engine.waitForBuild();
+    engine.swapInPending();
+    REQUIRE(engine.getCurrent() != nullptr);
+    REQUIRE(engine.getCurrent()->getTapsVersion() == 5);
+    REQUIRE(engine.getCurrent()->getNumChannels() == 2);
+
+    SECTION("and an engine that goes away waits for its build")
+    {
+        ConvolutionEngine other;
+        other.build(makeTapSettings(480000.0, 1));
+    }
+}
+
+TEST_CASE("DelayBuffer puts every rep where the convolution engine puts its tap", "[ConvolutionEngine]")
+{
+    // every rep of a 100.4 sample delay falls between two samples
+    const float delayInSamples = 100.4f;
+    for (const auto &taps : {DelayBuffer::Taps{}, DelayBuffer::Taps::withSwing(0.2f)})
+    {
+        std::vector<float> storage(DelayBuffer::getRequiredStorageSize(1000));
+        DelayBuffer delayBuffer;
+        delayBuffer.setStorage(storage.data(), 1000);
+        DelaySettings settings(delayInSamples, {0.5f, 0.4f, 0.3f, 0.2f, 0.1f}, DelayBuffer::maxReps);
+        settings.taps = taps;
+        auto output = processDelayBuffer(delayBuffer, settings, 700, 700);
+
+        double offsets[DelayBuffer::maxReps] = {};
+        taps.getOffsets(offsets, DelayBuffer::maxReps);
+        for (auto &offset : offsets)
+            offset *= delayInSamples;
+        float gains[DelayBuffer::maxReps] = {0.5f, 0.4f, 0.3f, 0.2f, 0.1f};
+        auto impulseResponse = ConvolutionEngine::makeTapImpulseResponse(offsets, DelayBuffer::maxReps, gains);
+        impulseResponse[0] += 1.0f;
+        impulseResponse.resize(output.size(), 0.0f);
+        for (size_t i = 0; i < output.size(); ++i)
+        {
+            INFO("sample " << i);
+            REQUIRE(output[i] == Catch::Approx(impulseResponse[i]).margin(0.0001f));
+        }
+    }
+}
+
+// Sets a parameter to a value in its own range, the way the host would
+static void setParameter(DelayThingAudioProcessor &delayThing, const juce::String &parameterID, float value)
+{
+    auto *parameter = delayThing.getValueTreeState().getParameter(parameterID);
+    parameter->setValueNotifyingHost(parameter->convertTo0to1(value));
+}
+
+// Processes numSamples of noise through both processors and returns the largest difference
+static float compareEngines(DelayThingAudioProcessor &direct, DelayThingAudioProcessor &convolution, int numSamples, int blockSize, juce::Random &random)
+{
+    juce::MidiBuffer midi;
+    juce::AudioBuffer<float> directBuffer(2, blockSize);
+    juce::AudioBuffer<float> convolutionBuffer(2, blockSize);
+    float maxDifference = 0.0f;
+    for (int processed = 0; processed < numSamples; processed += blockSize)
+    {
+        for (int channel = 0; channel < 2; ++channel)
+            for (int sample = 0; sample < blockSize; ++sample)
+                directBuffer.setSample(channel, sample, random.nextFloat() * 2.0f - 1.0f);
+        convolutionBuffer.makeCopyOf(directBuffer);
+        direct.processBlock(directBuffer, midi);
+        convolution.processBlock(convolutionBuffer, midi);
+        for (int channel = 0; channel < 2; ++channel)
+            for (int sample = 0; sample < blockSize; ++sample)
+                maxDifference = juce::jmax(maxDifference, std::abs(directBuffer.getSample(channel, sample) - convolutionBuffer.getSample(channel, sample)));
+    }
+    return maxDifference;
+}
+
+TEST_CASE("The convolution engine sounds like the direct engine", "[DelayThing]")
+{
+    auto gui = juce::ScopedJuceInitialiser_GUI{};
+    const int blockSize = 256;
+    DelayThingAudioProcessor direct;
+    DelayThingAudioProcessor convolution;
+    for (auto *delayThing : {&direct, &convolution})
+    {
+        delayThing->setRateAndBufferSizeDetails(48000.0, blockSize);
+        delayThing->prepareToPlay(48000.0, blockSize);
+    }
+    setParameter(convolution, convolution.delayEngineParamName, 1.0f);
+    convolution.updateImpulseResponse();
+    convolution.waitForImpulseResponse();
+
+    juce::Random random(42);
+    // the default 200ms delay with 2 reps reaches 19200 samples back
+    REQUIRE(compareEngines(direct, convolution, 24000, blockSize, random) < 0.001f);
+    REQUIRE(convolution.isConvolutionActive());
+
+    SECTION("and falls back to the direct engine while the delay time moves")
+    {
+        for (auto *delayThing : {&direct, &convolution})
+            setParameter(*delayThing, delayThing->delayTimeParamName, 300.0f);
+        compareEngines(direct, convolution, blockSize, blockSize, random);
+        REQUIRE_FALSE(convolution.isConvolutionActive());
+
+        // once the new impulse response is in, the convolution engine takes over
+        // again as soon as the old one has rung out
+        convolution.updateImpulseResponse();
+        convolution.waitForImpulseResponse();
+        int numBlocks = 0;
+        while (!convolution.isConvolutionActive() && numBlocks < 1000)
+        {
+            compareEngines(direct, convolution, blockSize, blockSize, random);
+            ++numBlocks;
+        }
+        REQUIRE(convolution.isConvolutionActive());
+
+        // The engines treat echoes that were in flight during the change differently,
+        // give those a second to ring out before comparing again. The blocks are bigger
+        // than prepareToPlay said they would be, so the direct engine's tail drains in pieces.
+        compareEngines(direct, convolution, 48000, 3 * blockSize, random);
+        REQUIRE(compareEngines(direct, convolution, 48000, blockSize, random) < 0.001f);
+    }
+}
+
+TEST_CASE("The convolution engine sounds like the direct engine between samples", "[DelayThing]")
+{
+    auto gui = juce::ScopedJuceInitialiser_GUI{};
+    const int blockSize = 256;
+    DelayThingAudioProcessor direct;
+    DelayThingAudioProcessor convolution;
+    for (auto *delayThing : {&direct, &convolution})
+    {
+        // 201ms at 44.1kHz is 8864.1 samples, so every rep falls between two samples
+        setParameter(*delayThing, delayThing->delayTimeParamName, 201.0f);
+        setParameter(*delayThing, delayThing->delayRepsParamName, 5.0f);
+        delayThing->setRateAndBufferSizeDetails(44100.0, blockSize);
+        delayThing->prepareToPlay(44100.0, blockSize);
+    }
+    setParameter(convolution, convolution.delayEngineParamName, 1.0f);
+    convolution.updateImpulseResponse();
+    convolution.waitForImpulseResponse();
+
+    juce::Random random(7);
+    // 5 reps of 8864.1 samples reach 44321 samples back
+    REQUIRE(compareEngines(direct, convolution, 48000, blockSize, random) < 0.001f);
+    REQUIRE(convolution.isConvolutionActive());
+}
+
+TEST_CASE("DelayBuffer stays inside its storage when the delay jumps to the longest time", "[DelayBuffer]")
+{
+    // What prepareToPlay hands out for 2 seconds at 48kHz with 16 sample blocks
+    const int blockSize = 16;
+    const int bufferSize = 96000 + 2 * blockSize;
+    std::vector<float> storage(DelayBuffer::getRequiredStorageSize(bufferSize));
+    DelayBuffer delayBuffer;
+    delayBuffer.setStorage(storage.data(), bufferSize);
+    DelaySettings settings(9600, {0.5f});
+    settings.delaySize.setDecay(0.02f, 48000.0f);
+
+    // Come round to the start of the buffer, where the read position is the furthest from
+    // wrapping, then jump to 2 seconds. The smoothed delay time overshoots 96000 on the way.
+    processDelayBuffer(delayBuffer, settings, bufferSize, blockSize, false);
+    settings.delaySize.setTarget(96000);
+    auto output = processDelayBuffer(delayBuffer, settings, 96016, blockSize);
+    REQUIRE(output[96000] == Catch::Approx(0.5f).margin(0.001f));
+}
+
+TEST_CASE("DelayBuffer spaces the reps by the tap table", "[DelayBuffer]")
+{
+    const int bufferSize = 1000;
+    std::vector<float> storage(DelayBuffer::getRequiredStorageSize(bufferSize));
+    DelayBuffer delayBuffer;
+    delayBuffer.setStorage(storage.data(), bufferSize);
+
+    DelaySettings settings(100, {0.5f, 0.25f, 0.125f, 1.0f, 1.0f}, 3);
+    // odd reps land a quarter of the delay time late, even reps stay on the grid
+    settings.taps = DelayBuffer::Taps::withSwing(0.25f);
+    auto output = processDelayBuffer(delayBuffer, settings, 400, 400);
+
+    for (int i = 0; i < 400; ++i)
+    {
+        float expected = 0.0f;
+        if (i == 0)
+            expected = 1.0f;
+        else if (i == 125)
+            expected = 0.5f;
+        else if (i == 200)
+            expected = 0.25f;
+        else if (i == 325)
+            expected = 0.125f;
+        INFO("sample " << i);
+        REQUIRE(output[static_cast<size_t>(i)] == expected);
+    }
+}
+
+struct TestPlayHead : juce::AudioPlayHead
+{
+    juce::Optional<PositionInfo> getPosition() const override
+    {
+        PositionInfo position;
+        position.setBpm(bpm);
+        return position;
+    }
+    double bpm = 120.0;
+};
+
+TEST_CASE("DelayThingAudioProcessor follows the host tempo when synced", "[DelayThing]")
+{
+    auto gui = juce::ScopedJuceInitialiser_GUI{};
+    const int blockSize = 512;
+    TestPlayHead playHead;
+    DelayThingAudioProcessor delayThing;
+    delayThing.setPlayHead(&playHead);
+    delayThing.setRateAndBufferSizeDetails(48000.0, blockSize);
+    delayThing.prepareToPlay(48000.0, blockSize);
+    setParameter(delayThing, delayThing.delaySyncParamName, 1.0f);
+
+    SECTION("a quarter note at 120bpm")
+    {
+        REQUIRE(processPlugin(delayThing, 24001, blockSize)[24000] == Catch::Approx(0.5f).margin(0.005f));
+    }
+
+    SECTION("a dotted eighth at 100bpm")
+    {
+        playHead.bpm = 100.0;
+        setParameter(delayThing, delayThing.delayDivisionParamName, 3.0f);
+        setParameter(delayThing, delayThing.delayFeelParamName, 1.0f);
+        REQUIRE(processPlugin(delayThing, 21601, blockSize)[21600] == Catch::Approx(0.5f).margin(0.005f));
+    }
+
+    SECTION("a tempo change takes effect from the block it shows up in")
+    {
+        // The echo is due at 24000 samples. The host slows down to 100bpm in the block
+        // the echo is due in, so the echo that is already on its way lands at 28800 instead.
+        const int changeAt = 24000 / blockSize * blockSize;
+        auto output = processPlugin(delayThing, changeAt, blockSize);
+        playHead.bpm = 100.0;
+        auto afterChange = processPlugin(delayThing, 28801 - changeAt, blockSize, false);
+        output.insert(output.end(), afterChange.begin(), afterChange.end());
+        REQUIRE(output[24000] == Catch::Approx(0.0f).margin(0.005f));
+        REQUIRE(output[28800] == Catch::Approx(0.5f).margin(0.005f));
+    }
+}